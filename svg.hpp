@@ -1,10 +1,28 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <fstream>
+#include <locale>
+#include <memory>
 #include <ostream>
+#include <sstream>
+#include <streambuf>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NAIVE_SVG_SSE2 1
+#elif (defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define NAIVE_SVG_NEON 1
+#endif
+
 namespace cubao
 {
 struct SVG
@@ -94,9 +112,56 @@ struct SVG
                                         const SVG::Circle &c);
     };
 
+    struct Labels;
+
+    // interned text, escaped once and shared by all Text elements using it,
+    // only Labels::intern creates them
+    struct Label
+    {
+        const std::string &text() const { return raw; }
+        const std::string &xml() const
+        {
+            return escaped.empty() ? raw : escaped;
+        }
+
+      private:
+        explicit Label(const std::string &text);
+        friend struct Labels;
+
+        std::string raw;
+        std::string escaped; // empty if raw needs no escaping
+    };
+
+    struct Labels
+    {
+        std::shared_ptr<const Label> intern(const std::string &text);
+        size_t size() const { return table.size(); }
+
+      private:
+        struct Hash
+        {
+            size_t operator()(const std::string *s) const
+            {
+                return std::hash<std::string>()(*s);
+            }
+        };
+        struct Equal
+        {
+            bool operator()(const std::string *a, const std::string *b) const
+            {
+                return *a == *b;
+            }
+        };
+        // keyed by the label's own text, so each string is stored once
+        std::unordered_map<const std::string *, std::shared_ptr<const Label>,
+                           Hash, Equal>
+            table;
+    };
+
     struct Text : Element
     {
         std::string text;
+        std::shared_ptr<const Label> label; // used instead of text if set
         double fontsize;
         Text(std::vector<double> _p, std::string _text,
              Color _fill = Color::BLACK, double _fontsize = 10)
@@ -108,13 +173,52 @@ struct SVG
             : Text({_x, _y}, _text, _fill, _fontsize)
         {
         }
+        Text(std::vector<double> _p, std::shared_ptr<const Label> _label,
+             Color _fill = Color::BLACK, double _fontsize = 10)
+            : Element({_p}, _fill), label(_label), fontsize(_fontsize)
+        {
+        }
+        Text(double _x, double _y, std::shared_ptr<const Label> _label,
+             Color _fill = Color::BLACK, double _fontsize = 10)
+            : Text({_x, _y}, _label, _fill, _fontsize)
+        {
+        }
 
         friend std::ostream &operator<<(std::ostream &out, const SVG::Text &t);
     };
 
-    void save(std::string path) const;
+    // optional render instrumentation, counters accumulate across calls
+    // so one instance can cover a whole job
+    struct RenderStats
+    {
+        struct Counter
+        {
+            size_t count = 0;
+            size_t vertices = 0;
+            size_t bytes = 0;
+        };
+        Counter grid, polygons, polylines, circles, texts;
+        size_t bytes = 0;          // formatted size, also if save() failed
+        size_t reserved_bytes = 0; // bytes reserved from size_hint()
+        size_t reallocations = 0;  // output buffer grew past the hint
+        size_t io_failures = 0;    // save() could not write the file
+        double transform_ms = 0.0; // fit_to_bbox
+        double sizing_ms = 0.0;    // size_hint() before to_string
+        double format_ms = 0.0;    // serializing, write() / to_string()
+        double io_ms = 0.0;        // writing to disk in save()
+        std::string to_json() const;
+    };
+
+    // upper bound of serialized length with the classic locale, exact when
+    // all numbers are integers below 1e6
+    size_t size_hint() const;
+    std::string to_string(RenderStats *stats = nullptr) const;
+    // returns false if the file could not be written
+    bool save(std::string path, RenderStats *stats = nullptr) const;
+    void write(std::ostream &out, RenderStats *stats = nullptr) const;
 
-    void fit_to_bbox(double xmin, double xmax, double ymin, double ymax);
+    void fit_to_bbox(double xmin, double xmax, double ymin, double ymax,
+                     RenderStats *stats = nullptr);
 
     double width, height;
     std::vector<Polygon> polygons;
@@ -185,6 +289,132 @@ std::ostream &operator<<(std::ostream &out, const SVG::Circle &c)
     return out;
 }
 
+namespace detail
+{
+inline const char *xml_entity(char c)
+{
+    switch (c) {
+    case '<':
+        return "&lt;";
+    case '>':
+        return "&gt;";
+    case '&':
+        return "&amp;";
+    case '\'':
+        return "&apos;";
+    case '"':
+        return "&quot;";
+    default:
+        return nullptr;
+    }
+}
+
+// offset of the first byte in [s, s + n) that needs escaping, or n
+inline size_t xml_scan(const char *s, size_t n)
+{
+    size_t i = 0;
+#ifdef NAIVE_SVG_SSE2
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'),
+                  amp = _mm_set1_epi8('&'), apos = _mm_set1_epi8('\''),
+                  quot = _mm_set1_epi8('"');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp),
+                                      _mm_cmpeq_epi8(v, apos)),
+                         _mm_cmpeq_epi8(v, quot)));
+        if (_mm_movemask_epi8(m)) {
+            break;
+        }
+    }
+#elif defined(NAIVE_SVG_NEON)
+    const uint8x16_t lt = vdupq_n_u8('<'), gt = vdupq_n_u8('>'),
+                     amp = vdupq_n_u8('&'), apos = vdupq_n_u8('\''),
+                     quot = vdupq_n_u8('"');
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(s + i));
+        uint8x16_t m = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, lt), vceqq_u8(v, gt)),
+            vorrq_u8(vorrq_u8(vceqq_u8(v, amp), vceqq_u8(v, apos)),
+                     vceqq_u8(v, quot)));
+        if (vmaxvq_u8(m)) {
+            break;
+        }
+    }
+#endif
+    while (i < n && !xml_entity(s[i])) {
+        ++i;
+    }
+    return i;
+}
+
+inline size_t xml_escaped_size(const std::string &text)
+{
+    const size_t n = text.size();
+    size_t size = n;
+    for (size_t i = xml_scan(text.data(), n); i < n;
+         i += 1 + xml_scan(text.data() + i + 1, n - i - 1)) {
+        size += std::char_traits<char>::length(xml_entity(text[i])) - 1;
+    }
+    return size;
+}
+
+inline std::string xml_escape(const std::string &text)
+{
+    std::string escaped;
+    escaped.reserve(xml_escaped_size(text));
+    const char *s = text.data();
+    size_t n = text.size();
+    while (n) {
+        size_t k = xml_scan(s, n);
+        escaped.append(s, k);
+        if (k == n) {
+            break;
+        }
+        escaped.append(xml_entity(s[k]));
+        s += k + 1;
+        n -= k + 1;
+    }
+    return escaped;
+}
+
+// copies clean runs in bulk, only special bytes go through xml_entity
+inline void xml_escape(std::ostream &out, const std::string &text)
+{
+    const char *s = text.data();
+    size_t n = text.size();
+    while (n) {
+        size_t k = xml_scan(s, n);
+        out.write(s, k);
+        if (k == n) {
+            break;
+        }
+        out << xml_entity(s[k]);
+        s += k + 1;
+        n -= k + 1;
+    }
+}
+} // namespace detail
+
+SVG::Label::Label(const std::string &text) : raw(text)
+{
+    if (detail::xml_scan(text.data(), text.size()) != text.size()) {
+        escaped = detail::xml_escape(text);
+    }
+}
+
+std::shared_ptr<const SVG::Label> SVG::Labels::intern(const std::string &text)
+{
+    auto itr = table.find(&text);
+    if (itr != table.end()) {
+        return itr->second;
+    }
+    std::shared_ptr<const Label> label(new Label(text));
+    table.emplace(&label->text(), label);
+    return label;
+}
+
 std::ostream &operator<<(std::ostream &out, const SVG::Text &t)
 {
     out << "<text"                                    //
@@ -192,52 +422,385 @@ std::ostream &operator<<(std::ostream &out, const SVG::Text &t)
         << " fill='" << t.fill << "'"                 //
         << " font-size='" << t.fontsize << "'"        //
         << " font-family='monospace'"                 //
-        << ">" << t.text << "</text>";
+        << ">";
+    if (t.label) {
+        out << t.label->xml();
+    } else {
+        detail::xml_escape(out, t.text);
+    }
+    out << "</text>";
     return out;
 }
 
-std::ostream &operator<<(std::ostream &out, const SVG &s)
+namespace detail
+{
+inline double elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - since)
+        .count();
+}
+
+// length of `out << v` with default stream formatting
+inline size_t int_size(int v)
+{
+    long long a = v;
+    size_t n = 1;
+    if (a < 0) {
+        a = -a;
+        ++n;
+    }
+    while (a >= 10) {
+        a /= 10;
+        ++n;
+    }
+    return n;
+}
+
+// upper bound of `out << v` with default stream formatting (%g, precision 6)
+inline size_t double_size_bound(double v)
+{
+    if (std::isnan(v) || std::isinf(v)) {
+        return 4; // "-nan", "-inf"
+    }
+    size_t n = std::signbit(v) ? 1 : 0;
+    double a = std::fabs(v);
+    if (a == 0) {
+        return n + 1;
+    }
+    if (a < 1e-4 || a >= 1e6) {
+        return n + 12; // d.ddddde+XXX
+    }
+    if (a < 1) {
+        size_t zeros = a < 1e-3 ? 3 : a < 1e-2 ? 2 : a < 1e-1 ? 1 : 0;
+        return n + 2 + zeros + 6; // 0.00dddddd
+    }
+    size_t digits = a < 1e1   ? 1
+                    : a < 1e2 ? 2
+                    : a < 1e3 ? 3
+                    : a < 1e4 ? 4
+                    : a < 1e5 ? 5
+                              : 6;
+    if (a == std::floor(a)) {
+        return n + digits;
+    }
+    return n + (digits == 6 ? 6 : 7); // dd.dddd
+}
+
+inline size_t color_size_bound(const SVG::Color &c)
+{
+    if (c.invalid()) {
+        return 4; // none
+    }
+    size_t n = int_size(c.r) + int_size(c.g) + int_size(c.b);
+    if (0.0 <= c.a && c.a <= 1.0) {
+        return n + 5 + 3 + double_size_bound(c.a) + 1; // rgba(r,g,b,a)
+    }
+    return n + 4 + 2 + 1; // rgb(r,g,b)
+}
+
+inline size_t polyline_size_bound(bool closed, const SVG::Color &stroke,
+                                  double stroke_width, const SVG::Color &fill,
+                                  size_t n_points)
+{
+    // "<polygon"/"<polyline" " style='stroke:" ";stroke-width:" ";fill:"
+    // "'" " points='" ... "'" " />"
+    return (closed ? 8 : 9) + 15 + color_size_bound(stroke) + 14 +
+           double_size_bound(stroke_width) + 6 + color_size_bound(fill) + 1 +
+           9 + 2 * n_points + 1 + 3;
+}
+
+inline size_t polyline_size_bound(const SVG::Polyline &p)
+{
+    size_t n = polyline_size_bound(p.isClosed(), p.stroke, p.stroke_width,
+                                   p.fill, p.points.size());
+    for (auto &pt : p.points) {
+        n += double_size_bound(pt[0]) + double_size_bound(pt[1]);
+    }
+    return n;
+}
+
+// writes straight into a caller-owned (pre-reserved) string, using its
+// storage as the put area so formatting needs no virtual call per byte
+struct StringSink : std::streambuf
+{
+    explicit StringSink(std::string &_buf) : buf(_buf)
+    {
+        size_t n = buf.size();
+        buf.resize(buf.capacity());
+        reset(n);
+    }
+    ~StringSink() { buf.resize(count()); }
+    size_t count() const { return pptr() - pbase(); }
+
+  protected:
+    int_type overflow(int_type ch) override
+    {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) {
+            return traits_type::not_eof(ch);
+        }
+        size_t n = count();
+        buf.resize(std::max<size_t>(2 * buf.size(), 64));
+        reset(n);
+        return sputc(traits_type::to_char_type(ch));
+    }
+
+  private:
+    void reset(size_t n)
+    {
+        char *data = &buf[0];
+        setp(data, data + buf.size());
+        for (; n > size_t(INT_MAX); n -= INT_MAX) {
+            pbump(INT_MAX);
+        }
+        pbump(int(n));
+    }
+
+    std::string &buf;
+};
+
+// counts bytes forwarded to another streambuf
+struct CountingStreambuf : std::streambuf
 {
-    out << "<svg width='" << s.width << "' height='" << s.height << "'"
+    explicit CountingStreambuf(std::streambuf *_target) : target(_target) {}
+    size_t count() const { return n; }
+
+  protected:
+    int_type overflow(int_type ch) override
+    {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) {
+            return traits_type::not_eof(ch);
+        }
+        int_type ret = target->sputc(traits_type::to_char_type(ch));
+        if (!traits_type::eq_int_type(ret, traits_type::eof())) {
+            ++n;
+        }
+        return ret;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize count) override
+    {
+        std::streamsize written = target->sputn(s, count);
+        n += written;
+        return written;
+    }
+    int sync() override { return target->pubsync(); }
+
+  private:
+    std::streambuf *target;
+    size_t n = 0;
+};
+
+// counter (StringSink or CountingStreambuf) reports bytes written so far
+template <typename Counter>
+void render(const SVG &svg, std::ostream &out, SVG::RenderStats *stats,
+            const Counter *counter)
+{
+    using RenderStats = SVG::RenderStats;
+    size_t pos = 0;
+    auto account = [&](RenderStats::Counter RenderStats::*section,
+                       size_t count, size_t vertices) {
+        if (!stats) {
+            return;
+        }
+        RenderStats::Counter &c = stats->*section;
+        c.count += count;
+        c.vertices += vertices;
+        c.bytes += counter->count() - pos;
+        pos = counter->count();
+    };
+
+    out << "<svg width='" << svg.width << "' height='" << svg.height << "'"
         << " xmlns='http://www.w3.org/2000/svg'>";
-    if (!s.background.invalid()) {
+    if (!svg.background.invalid()) {
         out << "\n\t<rect width='100%' height='100%' fill='" //
-            << s.background                                  //
+            << svg.background                                //
             << "'/>";
     }
-    if (s.grid_step > 0) {
-        SVG::Color grid_color = SVG::Color::GRAY;
-        if (!s.grid_color.invalid()) {
-            grid_color = s.grid_color;
+    if (stats) {
+        pos = counter->count();
+    }
+    if (svg.grid_step > 0) {
+        SVG::Color color = SVG::Color::GRAY;
+        if (!svg.grid_color.invalid()) {
+            color = svg.grid_color;
         }
-        for (double i = 0; i < s.height; i += s.grid_step) {
-            out << "\n\t" << SVG::Polyline({{0, i}, {s.width, i}}, grid_color);
+        size_t n_lines = 0;
+        for (double i = 0; i < svg.height; i += svg.grid_step, ++n_lines) {
+            out << "\n\t" << SVG::Polyline({{0, i}, {svg.width, i}}, color);
         }
-        for (double j = 0; j < s.width; j += s.grid_step) {
-            out << "\n\t" << SVG::Polyline({{j, 0}, {j, s.height}}, grid_color);
+        for (double j = 0; j < svg.width; j += svg.grid_step, ++n_lines) {
+            out << "\n\t" << SVG::Polyline({{j, 0}, {j, svg.height}}, color);
         }
+        account(&RenderStats::grid, n_lines, 2 * n_lines);
     }
-    for (auto &p : s.polygons) {
+    size_t vertices = 0;
+    for (auto &p : svg.polygons) {
         out << "\n\t" << p;
+        vertices += p.points.size();
     }
-    for (auto &p : s.polylines) {
+    account(&RenderStats::polygons, svg.polygons.size(), vertices);
+    vertices = 0;
+    for (auto &p : svg.polylines) {
         out << "\n\t" << p;
+        vertices += p.points.size();
     }
-    for (auto &c : s.circles) {
+    account(&RenderStats::polylines, svg.polylines.size(), vertices);
+    for (auto &c : svg.circles) {
         out << "\n\t" << c;
     }
-    for (auto &t : s.texts) {
+    account(&RenderStats::circles, svg.circles.size(), svg.circles.size());
+    for (auto &t : svg.texts) {
         out << "\n\t" << t;
     }
+    account(&RenderStats::texts, svg.texts.size(), svg.texts.size());
     out << "\n</svg>";
+}
+} // namespace detail
+
+std::ostream &operator<<(std::ostream &out, const SVG &s)
+{
+    s.write(out);
     return out;
 }
 
-void SVG::save(std::string path) const
+void SVG::write(std::ostream &out, RenderStats *stats) const
 {
+    if (!stats) {
+        detail::render<detail::CountingStreambuf>(*this, out, nullptr,
+                                                  nullptr);
+        return;
+    }
+    auto tic = std::chrono::steady_clock::now();
+    detail::CountingStreambuf counter(out.rdbuf());
+    std::ostream counted(&counter);
+    counted.copyfmt(out);
+    detail::render(*this, counted, stats, &counter);
+    if (!counted) {
+        out.setstate(std::ios_base::badbit);
+    }
+    stats->bytes += counter.count();
+    stats->format_ms += detail::elapsed_ms(tic);
+}
+
+size_t SVG::size_hint() const
+{
+    using detail::color_size_bound;
+    using detail::double_size_bound;
+    using detail::polyline_size_bound;
+    size_t n = 12 + double_size_bound(width) + 10 + double_size_bound(height) +
+               1 + 36; // <svg width='' height='' xmlns=''>
+    if (!background.invalid()) {
+        // \n\t<rect width='100%' height='100%' fill=''/>
+        n += 41 + color_size_bound(background) + 3;
+    }
+    if (grid_step > 0) {
+        SVG::Color color = SVG::Color::GRAY;
+        if (!grid_color.invalid()) {
+            color = grid_color;
+        }
+        size_t line = 2 + polyline_size_bound(false, color, 1.0, Color(-1), 2);
+        for (double i = 0; i < height; i += grid_step) {
+            n += line + double_size_bound(0) + double_size_bound(width) +
+                 2 * double_size_bound(i);
+        }
+        for (double j = 0; j < width; j += grid_step) {
+            n += line + double_size_bound(0) + double_size_bound(height) +
+                 2 * double_size_bound(j);
+        }
+    }
+    for (auto &p : polygons) {
+        n += 2 + polyline_size_bound(p);
+    }
+    for (auto &p : polylines) {
+        n += 2 + polyline_size_bound(p);
+    }
+    for (auto &c : circles) {
+        // \n\t<circle r='' cx='' cy='' style='stroke:;stroke-width:;fill:' />
+        n += 2 + 11 + double_size_bound(c.r) + 6 + double_size_bound(c.x()) +
+             6 + double_size_bound(c.y()) + 1 + 15 +
+             color_size_bound(c.stroke) + 14 +
+             double_size_bound(c.stroke_width) + 6 +
+             color_size_bound(c.fill) + 1 + 3;
+    }
+    for (auto &t : texts) {
+        // \n\t<text x='' y='' fill='' font-size='' font-family='monospace'>
+        // </text>
+        n += 2 + 5 + 4 + double_size_bound(t.x()) + 5 +
+             double_size_bound(t.y()) + 1 + 7 + color_size_bound(t.fill) + 1 +
+             12 + double_size_bound(t.fontsize) + 1 + 24 + 1 +
+             (t.label ? t.label->xml().size()
+                      : detail::xml_escaped_size(t.text)) + 7;
+    }
+    return n + 7; // \n</svg>
+}
+
+std::string SVG::to_string(RenderStats *stats) const
+{
+    auto tic = std::chrono::steady_clock::now();
+    size_t hint = size_hint();
+    std::string buf;
+    buf.reserve(hint);
+    size_t capacity = buf.capacity();
+    if (stats) {
+        stats->sizing_ms += detail::elapsed_ms(tic);
+        stats->reserved_bytes += hint;
+    }
+    tic = std::chrono::steady_clock::now();
+    {
+        detail::StringSink sink(buf);
+        std::ostream out(&sink);
+        out.imbue(std::locale::classic());
+        detail::render(*this, out, stats, &sink);
+    }
+    if (stats) {
+        stats->format_ms += detail::elapsed_ms(tic);
+        stats->bytes += buf.size();
+        if (buf.capacity() != capacity) {
+            ++stats->reallocations;
+        }
+    }
+    return buf;
+}
+
+bool SVG::save(std::string path, RenderStats *stats) const
+{
+    std::string buf = to_string(stats);
+    auto tic = std::chrono::steady_clock::now();
     std::ofstream file(path);
-    file << *this;
+    file.write(buf.data(), buf.size());
     file.close();
+    if (stats) {
+        stats->io_ms += detail::elapsed_ms(tic);
+        if (!file) {
+            ++stats->io_failures;
+        }
+    }
+    return bool(file);
+}
+
+std::string SVG::RenderStats::to_json() const
+{
+    std::ostringstream out;
+    auto counter = [&](const char *key, const Counter &c) {
+        out << "\"" << key << "\":{\"count\":" << c.count
+            << ",\"vertices\":" << c.vertices << ",\"bytes\":" << c.bytes
+            << "},";
+    };
+    out << "{";
+    counter("grid", grid);
+    counter("polygons", polygons);
+    counter("polylines", polylines);
+    counter("circles", circles);
+    counter("texts", texts);
+    out << "\"bytes\":" << bytes                     //
+        << ",\"reserved_bytes\":" << reserved_bytes  //
+        << ",\"reallocations\":" << reallocations    //
+        << ",\"io_failures\":" << io_failures        //
+        << ",\"transform_ms\":" << transform_ms      //
+        << ",\"sizing_ms\":" << sizing_ms            //
+        << ",\"format_ms\":" << format_ms            //
+        << ",\"io_ms\":" << io_ms << "}";
+    return out.str();
 }
 
 void interp(std::vector<std::vector<double>> &points,           //
@@ -252,8 +815,10 @@ void interp(std::vector<std::vector<double>> &points,           //
     }
 }
 
-void SVG::fit_to_bbox(double xmin, double xmax, double ymin, double ymax)
+void SVG::fit_to_bbox(double xmin, double xmax, double ymin, double ymax,
+                      RenderStats *stats)
 {
+    auto tic = std::chrono::steady_clock::now();
     for (auto &p : polygons) {
         interp(p.points, xmin, xmax, ymin, ymax, width, height);
     }
@@ -266,5 +831,8 @@ void SVG::fit_to_bbox(double xmin, double xmax, double ymin, double ymax)
     for (auto &t : texts) {
         interp(t.points, xmin, xmax, ymin, ymax, width, height);
     }
+    if (stats) {
+        stats->transform_ms += detail::elapsed_ms(tic);
+    }
 }
 } // namespace cubao
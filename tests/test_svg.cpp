@@ -3,6 +3,7 @@
 
 #include <chrono>
 #include <iostream>
+#include <locale>
 #include <sstream>
 
 using namespace std;
@@ -15,6 +16,187 @@ size_t unix_time()
         .count();
 }
 
+struct grouped_numpunct : std::numpunct<char>
+{
+    char do_thousands_sep() const override { return ','; }
+    std::string do_grouping() const override { return "\3"; }
+};
+
+bool check_render_stats()
+{
+    // integral coordinates, size_hint is exact
+    SVG svg(40, 30);
+    svg.grid_step = 10;
+    svg.background = SVG::Color::WHITE;
+    svg.circles.push_back(
+        SVG::Circle({10, 10}, 4, SVG::Color::BLACK, SVG::Color::GREEN));
+    svg.texts.push_back(SVG::Text({8, 6}, "some text", SVG::Color::RED, 8));
+    svg.polylines.push_back(SVG::Polyline({{1, 2}, {5, 3}, {8, 9}}));
+    svg.polygons.push_back(SVG::Polygon({{6, 8}, {11, 3}, {13, 14}},
+                                        SVG::Color::RED, 2,
+                                        SVG::Color(255, 255, 0)));
+    SVG::RenderStats stats;
+    string rendered = svg.to_string(&stats);
+    stringstream ss;
+    ss << svg;
+    const SVG::RenderStats::Counter *sections[] = {
+        &stats.grid, &stats.polygons, &stats.polylines, &stats.circles,
+        &stats.texts};
+    size_t section_bytes = 0;
+    for (auto *c : sections) {
+        if (!c->bytes) {
+            cerr << "empty section in " << stats.to_json() << endl;
+            return false;
+        }
+        section_bytes += c->bytes;
+    }
+    if (rendered != ss.str() || rendered.size() != svg.size_hint() ||
+        stats.bytes != rendered.size() ||
+        stats.reserved_bytes != rendered.size() || stats.reallocations ||
+        section_bytes > stats.bytes) {
+        cerr << "size_hint: " << svg.size_hint()
+             << ", rendered: " << rendered.size() << ", " << stats.to_json()
+             << endl;
+        return false;
+    }
+    // 3 horizontal (0, 10, 20) + 4 vertical (0, 10, 20, 30) grid lines
+    if (stats.grid.count != 7 || stats.grid.vertices != 14 ||
+        stats.polygons.count != 1 || stats.polygons.vertices != 3 ||
+        stats.polylines.count != 1 || stats.polylines.vertices != 3 ||
+        stats.circles.count != 1 || stats.texts.count != 1) {
+        cerr << "unexpected counts: " << stats.to_json() << endl;
+        return false;
+    }
+
+    // write() fills the same counters on any stream
+    SVG::RenderStats written;
+    ss.str("");
+    svg.write(ss, &written);
+    if (written.bytes != rendered.size() ||
+        written.grid.bytes != stats.grid.bytes ||
+        written.texts.bytes != stats.texts.bytes) {
+        cerr << "write: " << written.to_json() << endl;
+        return false;
+    }
+
+    // fractional coordinates, size_hint is a tight upper bound
+    SVG frac(40, 30);
+    frac.polylines.push_back(SVG::Polyline({{1.1, 2.2}, {5.1, 3.2}}));
+    frac.polygons.push_back(SVG::Polygon({{6.1, 8.2}, {11.2, 3}, {13.1, 14.2}},
+                                         SVG::Color::RED, 0.5,
+                                         SVG::Color(255, 255, 0, 0.5)));
+    size_t n = frac.to_string().size();
+    if (n > frac.size_hint() || frac.size_hint() > n * 5 / 4) {
+        cerr << "size_hint: " << frac.size_hint() << ", rendered: " << n
+             << endl;
+        return false;
+    }
+
+    // to_string ignores the global locale, size_hint assumes the classic one
+    SVG wide(12345, 3);
+    wide.polylines.push_back(SVG::Polyline({{1000, 5}, {2000, 1}}));
+    SVG::RenderStats wide_stats;
+    std::locale global =
+        std::locale::global(std::locale(std::locale(), new grouped_numpunct));
+    rendered = wide.to_string(&wide_stats);
+    std::locale::global(global);
+    if (rendered.find("width='12345'") == string::npos ||
+        rendered.find("points='1000,5 2000,1 '") == string::npos ||
+        rendered.size() != wide.size_hint() || wide_stats.reallocations) {
+        cerr << "locale leaked into to_string: " << rendered << endl;
+        return false;
+    }
+
+    if (svg.save("no/such/dir/test_svg.svg", &stats) ||
+        stats.io_failures != 1) {
+        cerr << "save should fail: " << stats.to_json() << endl;
+        return false;
+    }
+    return true;
+}
+
+string naive_xml_escape(const string &text)
+{
+    string escaped;
+    for (char c : text) {
+        switch (c) {
+        case '<':
+            escaped += "&lt;";
+            break;
+        case '>':
+            escaped += "&gt;";
+            break;
+        case '&':
+            escaped += "&amp;";
+            break;
+        case '\'':
+            escaped += "&apos;";
+            break;
+        case '"':
+            escaped += "&quot;";
+            break;
+        default:
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+bool check_xml_escape()
+{
+    vector<string> cases = {
+        "<road & 'name' of \"some\" length>",
+        // clean 16-byte blocks copied in bulk before the first special byte
+        "a clean run of more than 16 bytes <then> & more",
+        string(40, 'x'),
+        // special byte right at the 16-byte block boundaries
+        string(15, 'a') + "&" + string(20, 'b'),
+        string(16, 'a') + "<" + string(20, 'b'),
+        string(17, 'a') + "\"" + string(20, 'b'),
+        string(31, 'a') + "'" + string(16, 'b') + ">",
+        // high-bit bytes compare as negative in _mm_cmpeq_epi8
+        "\xe4\xb8\xad\xe6\x96\x87\xe8\xb7\xaf\xe5\x90\x8d\xe7\xa7\xb0"
+        "\xe6\xb5\x8b\xe8\xaf\x95<\xc3\xa9&\xff\x80\xbc\xa6\xa7\xa2",
+    };
+    string high(64, 0);
+    for (size_t i = 0; i < high.size(); ++i) {
+        high[i] = char(0x80 + 2 * i); // includes 0xbc ('<' | 0x80) etc.
+    }
+    cases.push_back(high);
+
+    SVG svg(40, 30);
+    SVG::Labels labels;
+    for (auto &raw : cases) {
+        svg.texts.push_back(SVG::Text({2, 20}, raw));
+        svg.texts.push_back(SVG::Text({2, 24}, labels.intern(raw)));
+        svg.texts.push_back(SVG::Text({2, 28}, labels.intern(raw)));
+    }
+    string rendered = svg.to_string();
+    if (labels.size() != cases.size() || rendered.size() != svg.size_hint()) {
+        cerr << "labels: " << labels.size() << ", size_hint: "
+             << svg.size_hint() << ", rendered: " << rendered.size() << endl;
+        return false;
+    }
+    for (auto &raw : cases) {
+        string escaped = naive_xml_escape(raw);
+        auto label = labels.intern(raw);
+        string element = ">" + escaped + "</text>";
+        size_t n_escaped = 0;
+        for (size_t i = rendered.find(element); i != string::npos;
+             i = rendered.find(element, i + 1)) {
+            ++n_escaped;
+        }
+        // repeated texts share one label and one copy of the string
+        if (label != labels.intern(raw) || label->text() != raw ||
+            label->xml() != escaped || n_escaped != 3) {
+            cerr << "xml escaping failed: " << raw << " -> " << label->xml()
+                 << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     if (argc > 1) {
@@ -38,6 +220,14 @@ int main(int argc, char **argv)
     ss << svg << endl;
     cout << svg << endl;
 
+    if (!check_render_stats()) {
+        return 1;
+    }
+
+    if (!check_xml_escape()) {
+        return 1;
+    }
+
     size_t epoch = unix_time();
     string path = to_string(epoch) + ".svg";
     svg.save(path);